@@ -3,11 +3,18 @@
 
 int main(int argc, char** argv) {
     Logger log;
-    GoRebuildYourself(argc, argv, log);
+    // ninja runs these in parallel so they cant all be swapping the binary out at once
+    if (argc < 2 || (string(argv[1]) != "scan" && string(argv[1]) != "collate" && string(argv[1]) != "remote")) {
+        GoRebuildYourself(argc, argv, log);
+    }
     Cli brick(log);
     brick.cmds.push_back({"gen", "generate a ninja build script", GenerateFunc});
     brick.cmds.push_back({"watch", "watch over files in src dir", WatchFunc});
     brick.cmds.push_back({"clean", "cleans the target directory", CleanFunc});
+    brick.cmds.push_back({"scan", "scan one file for module deps, ninja uses this", ScanFunc});
+    brick.cmds.push_back({"collate", "turn module scans into a dyndep file, ninja uses this", CollateFunc});
+    brick.cmds.push_back({"worker", "compile jobs sent over a socket (default " WorkerDefaultAddr ")", WorkerFunc});
+    brick.cmds.push_back({"remote", "compile one file on a worker, ninja uses this", RemoteFunc});
     brick.go(argc, argv);
     return 0;
 }
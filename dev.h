@@ -14,6 +14,13 @@
 #include <algorithm>
 #include <chrono>
 #include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
 #include <fstream>
 #ifdef _WIN32
 #include <Windows.h>
@@ -21,6 +28,11 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
 #include <unistd.h>
 #endif
 
@@ -32,11 +44,25 @@
 
 #define Compiler "clang++"
 #define ProjType ".cpp"
+#define ModuleType ".cppm"
+
+#define ScanDeps "clang-scan-deps"
+#define ModuleFlags {"-std=c++20"}
+#define PcmDir (string(ObjDir) + "/" + "pcm")
+#define ScanCacheDir (string(TargetDir) + "/" + "scan")
+#define DyndepFile (string(ObjDir) + "/" + "modules.dd")
+#define ScanCacheKeep 64
 
 #define CxxFlags {}
 #define LdFlags {}
 
-#define WatchDefaultExts {ProjType, ".h", ".build"}
+// "host:port" or "unix:/path", the DEV_WORKERS env var (comma separated) overrides this
+#define Workers {}
+#define WorkerDefaultAddr "127.0.0.1:7878"
+#define WorkerTimeout 60
+#define WorkerProtocol "1"
+
+#define WatchDefaultExts {ProjType, ModuleType, ".h", ".build"}
 
 using namespace std;
 namespace fs = filesystem;
@@ -124,7 +150,7 @@ struct Task {
     vector<string> cmd;
     string output = "";
 
-    int run(Logger log, bool saveToFile = false) {
+    int run(Logger log, bool saveToFile = false, bool quiet = false) {
         if (cmd.empty()) {
             log.SendMessage(LOGERROR, "task failed command is empty");
             return -1;
@@ -139,7 +165,9 @@ struct Task {
             fullCmd.pop_back();
         }
 
-        log.SendMessage(LOGINFO, "starting task '"+ fullCmd + "'");
+        if (!quiet) {
+            log.SendMessage(LOGINFO, "starting task '"+ fullCmd + "'");
+        }
 
         #ifdef _WIN32
             STARTUPINFO si = { sizeof(STARTUPINFO) };
@@ -384,6 +412,625 @@ struct BuildExtensionLexer {
     }
 };
 
+inline string ReadWholeFile(const string& path) {
+    ifstream in(path, ios::binary);
+    return string((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+}
+
+// fnv-1a, only used to key the scan cache so it doesnt need to be fancy
+inline string ContentHash(const string& data) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)hash);
+    return string(buf);
+}
+
+// only the first real line counts, past comments, #lines and a 'module;' global fragment
+inline bool HasModuleDecl(const string& content) {
+    istringstream in(content);
+    string line;
+    bool inComment = false;
+    while (getline(in, line)) {
+        // peel block comments off the front until real code or the end of the line shows up
+        for (;;) {
+            if (inComment) {
+                size_t close = line.find("*/");
+                if (close == string::npos) {
+                    line.clear();
+                    break;
+                }
+                inComment = false;
+                line.erase(0, close + 2);
+            }
+            line.erase(0, line.find_first_not_of(" \t\r"));
+            if (line.rfind("/*", 0) != 0) {
+                break;
+            }
+            inComment = true;
+            line.erase(0, 2);
+        }
+        if (line.empty() || line[0] == '#' || line.rfind("//", 0) == 0 || line.rfind("module;", 0) == 0) {
+            continue;
+        }
+        return line.rfind("export module ", 0) == 0 || line.rfind("module ", 0) == 0 || line.rfind("import ", 0) == 0 || line.rfind("export import ", 0) == 0;
+    }
+    return false;
+}
+
+inline bool UsesModules() {
+    for (const auto& entry : fs::recursive_directory_iterator(SrcDir)) {
+        if (entry.path().extension() == ModuleType) {
+            return true;
+        } else if (entry.path().extension() == ProjType && HasModuleDecl(ReadWholeFile(entry.path().string()))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// clang wants partitions named like 'mod-part.pcm' when using -fprebuilt-module-path
+inline string PcmPath(string name) {
+    replace(name.begin(), name.end(), ':', '-');
+    return PcmDir + "/" + name + ".pcm";
+}
+
+// pulls every logical-name out of the "provides" or "requires" array of a p1689 scan
+inline vector<string> P1689Names(const string& json, const string& key) {
+    vector<string> names;
+    size_t pos = json.find("\"" + key + "\"");
+    if (pos == string::npos) {
+        return names;
+    }
+    size_t start = json.find('[', pos);
+    if (start == string::npos) {
+        return names;
+    }
+
+    int depth = 0;
+    bool inString = false;
+    size_t end = start;
+    for (; end < json.size(); end++) {
+        char c = json[end];
+        if (inString) {
+            if (c == '\\') {
+                end++;
+            } else if (c == '"') {
+                inString = false;
+            }
+        } else if (c == '"') {
+            inString = true;
+        } else if (c == '[') {
+            depth++;
+        } else if (c == ']' && --depth == 0) {
+            break;
+        }
+    }
+
+    string array = json.substr(start, end - start);
+    size_t at = 0;
+    while ((at = array.find("\"logical-name\"", at)) != string::npos) {
+        size_t colon = array.find(':', at);
+        size_t open = colon == string::npos ? string::npos : array.find('"', colon);
+        size_t close = open == string::npos ? string::npos : array.find('"', open + 1);
+        if (close == string::npos) {
+            break;
+        }
+        names.push_back(array.substr(open + 1, close - open - 1));
+        at = close + 1;
+    }
+    return names;
+}
+
+// reads the prerequisites out of a make style depfile, handles '\ ' and line continuations
+inline vector<string> ParseDepfile(const string& content) {
+    vector<string> deps;
+    size_t colon = content.find(": ");
+    if (colon == string::npos) {
+        return deps;
+    }
+
+    string dep;
+    for (size_t i = colon + 2; i < content.size(); i++) {
+        char c = content[i];
+        if (c == '\\' && i + 1 < content.size() && (content[i + 1] == ' ' || content[i + 1] == '#')) {
+            dep += content[++i];
+        } else if (c == '\\' && i + 1 < content.size() && (content[i + 1] == '\n' || content[i + 1] == '\r')) {
+            continue;
+        } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            if (!dep.empty()) {
+                deps.push_back(dep);
+            }
+            dep.clear();
+        } else {
+            dep += c;
+        }
+    }
+    if (!dep.empty()) {
+        deps.push_back(dep);
+    }
+    return deps;
+}
+
+inline string DepsHash(const vector<string>& deps) {
+    string all;
+    for (const auto& dep : deps) {
+        all += dep + "\n" + (fs::exists(dep) ? ContentHash(ReadWholeFile(dep)) : "missing") + "\n";
+    }
+    return ContentHash(all);
+}
+
+// leaves the file alone when nothing changed so restat can stop ninja cascading
+inline bool WriteIfChanged(const string& path, const string& content) {
+    if (fs::exists(path) && ReadWholeFile(path) == content) {
+        return true;
+    }
+    ofstream out(path, ios::binary);
+    out << content;
+    out.close();
+    return bool(out);
+}
+
+struct ModuleInfo {
+    string obj;
+    vector<string> provides;
+    vector<string> imports;
+};
+
+inline vector<string> WorkerList() {
+    vector<string> workers = Workers;
+    if (const char* env = getenv("DEV_WORKERS")) {
+        workers.clear();
+        string list = env;
+        size_t start = 0;
+        while (start <= list.size()) {
+            size_t comma = list.find(',', start);
+            string addr = list.substr(start, comma == string::npos ? string::npos : comma - start);
+            if (!addr.empty()) {
+                workers.push_back(addr);
+            }
+            if (comma == string::npos) {
+                break;
+            }
+            start = comma + 1;
+        }
+    }
+    return workers;
+}
+
+// the .ii is already preprocessed so these are just noise to a worker
+inline bool IsPreprocessorFlag(const string& flag, bool& takesNext) {
+    static const vector<string> separate = {"-I", "-D", "-U", "-include", "-imacros", "-isystem", "-iquote", "-idirafter", "-MF", "-MT", "-MQ"};
+    static const vector<string> prefixes = {"-I", "-D", "-U", "-isystem", "-iquote", "-idirafter", "-include", "-imacros", "-fprebuilt-module-path", "-MF", "-MT", "-MQ"};
+    takesNext = find(separate.begin(), separate.end(), flag) != separate.end();
+    if (takesNext || flag == "-M" || flag == "-MM" || flag == "-MD" || flag == "-MMD" || flag == "-MP") {
+        return true;
+    }
+    for (const auto& prefix : prefixes) {
+        if (flag.rfind(prefix, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// workers run Compiler with whatever they're sent so only plain codegen flags get through,
+// anything that names a file (@file, plugins, -B, -specs, -wrapper...) could run code on the box
+inline bool IsSafeWorkerFlag(const string& flag) {
+    static const vector<string> exact = {"-w", "-pedantic", "-pedantic-errors", "-pthread"};
+    static const vector<string> allowed = {"-O", "-g", "-std=", "-W", "-f", "-m"};
+    static const vector<string> denied = {
+        "-Wl,", "-Wa,", "-Wp,", "-gcc-toolchain", "-fplugin", "-fpass-plugin", "-fprofile", "-fmodule",
+        "-fprebuilt", "-fsanitize-blacklist", "-fsanitize-ignorelist", "-fsanitize-coverage-allowlist",
+        "-fsanitize-coverage-ignorelist", "-fsanitize-coverage-blocklist", "-fxray", "-fcrash-diagnostics",
+        "-fdebug-prefix-map", "-ffile-prefix-map", "-fmacro-prefix-map", "-fcoverage-prefix-map",
+        "-fdump", "-fopt-record-file", "-fsave-optimization-record", "-fproc-stat-report", "-ftime-trace",
+        "-fcallgraph-info", "-fstack-usage", "-fdiagnostics-add-output", "-mllvm"
+    };
+
+    if (find(exact.begin(), exact.end(), flag) != exact.end()) {
+        return true;
+    }
+    for (unsigned char c : flag) {
+        if (!isalnum(c) && c != '-' && c != '_' && c != '=' && c != '+' && c != ',' && c != '.') {
+            return false;
+        }
+    }
+    for (const auto& prefix : denied) {
+        if (flag.rfind(prefix, 0) == 0) {
+            return false;
+        }
+    }
+    // -march=native and friends would target the worker's cpu not ours
+    if (flag.size() >= 7 && flag.compare(flag.size() - 7, 7, "=native") == 0) {
+        return false;
+    }
+    for (const auto& prefix : allowed) {
+        if (flag.rfind(prefix, 0) == 0 && flag.size() > 1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifndef _WIN32
+using Deadline = chrono::steady_clock::time_point;
+
+inline Deadline JobDeadline() {
+    return chrono::steady_clock::now() + chrono::seconds(WorkerTimeout);
+}
+
+// waits for fd without going past the deadline, which covers the whole job not just one call
+inline bool WaitFor(int fd, short events, Deadline deadline) {
+    for (;;) {
+        long long left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        if (left <= 0) {
+            return false;
+        }
+        pollfd p = {fd, events, 0};
+        int n = poll(&p, 1, (int)min(left, 60000LL));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n != 0) {
+            return n > 0;
+        }
+    }
+}
+
+inline bool SendAll(int fd, const string& data, Deadline deadline) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        if (!WaitFor(fd, POLLOUT, deadline)) {
+            return false;
+        }
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, 0);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+inline bool RecvAll(int fd, string& data, size_t len, Deadline deadline) {
+    data.resize(len);
+    size_t got = 0;
+    while (got < len) {
+        if (!WaitFor(fd, POLLIN, deadline)) {
+            return false;
+        }
+        ssize_t n = recv(fd, &data[got], len - got, 0);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        got += n;
+    }
+    return true;
+}
+
+inline bool RecvLine(int fd, string& line, Deadline deadline) {
+    line.clear();
+    string c;
+    while (line.size() < 256) {
+        if (!RecvAll(fd, c, 1, deadline)) {
+            return false;
+        } else if (c[0] == '\n') {
+            return true;
+        }
+        line += c;
+    }
+    return false;
+}
+
+// a message is a list of 'name len\n<len bytes>' fields closed off with 'end 0\n'
+struct WireMessage {
+    map<string, string> fields;
+
+    bool Send(int fd, Deadline deadline) const {
+        string data;
+        for (const auto& [name, value] : fields) {
+            data += name + " " + to_string(value.size()) + "\n" + value;
+        }
+        data += "end 0\n";
+        return SendAll(fd, data, deadline);
+    }
+
+    bool Recv(int fd, Deadline deadline) {
+        fields.clear();
+        string line;
+        while (RecvLine(fd, line, deadline)) {
+            size_t space = line.find(' ');
+            if (space == string::npos) {
+                return false;
+            }
+            string name = line.substr(0, space);
+            if (name == "end") {
+                return true;
+            }
+
+            size_t len;
+            try {
+                len = stoull(line.substr(space + 1));
+            } catch (const exception&) {
+                return false;
+            }
+            if (len > (size_t(1) << 30) || !RecvAll(fd, fields[name], len, deadline)) {
+                return false;
+            }
+        }
+        return false;
+    }
+};
+
+// connects without blocking so a dead host can't eat more than the job deadline
+inline bool ConnectBy(int fd, const sockaddr* sa, socklen_t len, Deadline deadline) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(fd, sa, len) == 0) {
+        return true;
+    } else if (errno != EINPROGRESS || !WaitFor(fd, POLLOUT, deadline)) {
+        return false;
+    }
+    int err = 0;
+    socklen_t errLen = sizeof(err);
+    return getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) == 0 && err == 0;
+}
+
+// listens when server is set otherwise connects, returns -1 if that didnt work out
+inline int WorkerSocket(const string& addr, bool server, Logger log, Deadline deadline = Deadline()) {
+    if (addr.rfind("unix:", 0) == 0) {
+        string path = addr.substr(5);
+        sockaddr_un sa = {};
+        sa.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(sa.sun_path)) {
+            log.SendMessage(LOGERROR, "bad unix socket path '" + path + "'");
+            return -1;
+        }
+        strncpy(sa.sun_path, path.c_str(), sizeof(sa.sun_path) - 1);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (server) {
+            // only clear out a stale socket, a typo shouldnt be able to delete a real file
+            struct stat st;
+            if (lstat(path.c_str(), &st) == 0) {
+                if (!S_ISSOCK(st.st_mode)) {
+                    log.SendMessage(LOGERROR, "'" + path + "' already exists and isn't a socket");
+                    close(fd);
+                    return -1;
+                }
+                unlink(path.c_str());
+            }
+            if (bind(fd, (sockaddr*)&sa, sizeof(sa)) == 0 && listen(fd, 64) == 0) {
+                return fd;
+            }
+        } else if (ConnectBy(fd, (sockaddr*)&sa, sizeof(sa), deadline)) {
+            return fd;
+        }
+        close(fd);
+        return -1;
+    }
+
+    size_t colon = addr.rfind(':');
+    if (colon == string::npos) {
+        log.SendMessage(LOGERROR, "worker address '" + addr + "' needs to look like host:port or unix:/path");
+        return -1;
+    }
+    string host = addr.substr(0, colon);
+    string port = addr.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = server ? AI_PASSIVE : 0;
+    addrinfo* res = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0) {
+        log.SendMessage(LOGERROR, "failed to resolve worker address '" + addr + "'");
+        return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (server) {
+            int yes = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0) {
+                break;
+            }
+        } else if (ConnectBy(fd, ai->ai_addr, ai->ai_addrlen, deadline)) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// false means the worker couldnt take the job at all so try somewhere else
+inline bool RemoteCompile(const string& addr, const vector<string>& flags, const string& source, WireMessage& reply, Logger log, Deadline deadline) {
+    int fd = WorkerSocket(addr, false, log, deadline);
+    if (fd < 0) {
+        log.SendMessage(LOGWARNING, "worker '" + addr + "' is unreachable");
+        return false;
+    }
+
+    WireMessage hello;
+    if (!hello.Recv(fd, deadline) || hello.fields["dev"] != WorkerProtocol || hello.fields["status"] != "ready") {
+        log.SendMessage(LOGWARNING, "worker '" + addr + "' is busy or speaks a different protocol");
+        close(fd);
+        return false;
+    }
+
+    WireMessage job;
+    string joined;
+    for (const auto& flag : flags) {
+        joined += flag + "\n";
+    }
+    job.fields["flags"] = joined;
+    job.fields["source"] = source;
+    // closing on a timeout is what tells the worker to kill the compile
+    if (!job.Send(fd, deadline) || !reply.Recv(fd, deadline)) {
+        log.SendMessage(LOGWARNING, "worker '" + addr + "' dropped the job or took too long");
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+inline void ServeJob(int fd, Logger log) {
+    WireMessage job;
+    if (!job.Recv(fd, JobDeadline())) {
+        log.SendMessage(LOGWARNING, "got a broken job from the driver");
+        return;
+    } else if (job.fields.count("probe")) {
+        return;
+    }
+
+    WireMessage reply;
+    vector<string> cmd = {Compiler};
+    string flags = job.fields["flags"];
+    size_t start = 0;
+    size_t nl;
+    while ((nl = flags.find('\n', start)) != string::npos) {
+        string flag = flags.substr(start, nl - start);
+        start = nl + 1;
+        if (!IsSafeWorkerFlag(flag)) {
+            log.SendMessage(LOGWARNING, "rejecting job with flag '" + flag + "'");
+            reply.fields["status"] = "rejected";
+            reply.fields["output"] = "worker refused flag '" + flag + "'\n";
+            reply.Send(fd, JobDeadline());
+            return;
+        }
+        cmd.push_back(flag);
+    }
+
+    // mkdtemp so nobody else on the box can have the dir ready and waiting with symlinks in it
+    string tmpl = (fs::temp_directory_path() / "dev-worker-XXXXXX").string();
+    vector<char> dirBuf(tmpl.begin(), tmpl.end());
+    dirBuf.push_back('\0');
+    if (!mkdtemp(dirBuf.data())) {
+        log.SendMessage(LOGERROR, "failed to create a scratch directory for the job");
+        reply.fields["status"] = "failed";
+        reply.Send(fd, JobDeadline());
+        return;
+    }
+    fs::path dir = dirBuf.data();
+    string ii = (dir / "tu.ii").string();
+    string obj = (dir / "tu.o").string();
+    string out = (dir / "output.txt").string();
+    ofstream src(ii, ios::binary);
+    src << job.fields["source"];
+    src.close();
+    cmd.insert(cmd.end(), {"-c", ii, "-o", obj});
+
+    // compile in its own process group so the whole thing can be killed if the driver gives up
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        Task compile = {cmd};
+        int res = compile.run(log, true);
+        ofstream o(out, ios::binary);
+        o << compile.output;
+        o.close();
+        _exit(res < 0 ? 255 : res);
+    } else if (pid < 0) {
+        log.SendMessage(LOGERROR, "failed to fork process for compile");
+        fs::remove_all(dir);
+        return;
+    }
+    setpgid(pid, pid);
+
+    int status = 0;
+    pid_t done;
+    while ((done = waitpid(pid, &status, WNOHANG)) == 0 || (done < 0 && errno == EINTR)) {
+        pollfd p = {fd, POLLIN, 0};
+        char c;
+        if (poll(&p, 1, 100) > 0 && recv(fd, &c, 1, MSG_PEEK) <= 0) {
+            log.SendMessage(LOGWARNING, "driver hung up, killing the compile");
+            kill(-pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            fs::remove_all(dir);
+            return;
+        }
+    }
+
+    if (done < 0) {
+        log.SendMessage(LOGERROR, "lost track of the compile process");
+        kill(-pid, SIGKILL);
+        reply.fields["status"] = "failed";
+        reply.Send(fd, JobDeadline());
+        fs::remove_all(dir);
+        return;
+    }
+
+    int res = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    reply.fields["status"] = to_string(res);
+    reply.fields["output"] = ReadWholeFile(out);
+    if (res == 0) {
+        reply.fields["object"] = ReadWholeFile(obj);
+    }
+    if (!reply.Send(fd, JobDeadline())) {
+        log.SendMessage(LOGWARNING, "failed to send the object back to the driver");
+    }
+    fs::remove_all(dir);
+}
+
+// asks every worker how many jobs it runs, unreachable ones just count as zero
+inline unsigned int WorkerCapacity(const vector<string>& workers, Logger log) {
+    unsigned int jobs = 0;
+    for (const auto& addr : workers) {
+        Deadline deadline = chrono::steady_clock::now() + chrono::seconds(2);
+        int fd = WorkerSocket(addr, false, log, deadline);
+        if (fd < 0) {
+            log.SendMessage(LOGWARNING, "worker '" + addr + "' is unreachable");
+            continue;
+        }
+        WireMessage hello;
+        if (hello.Recv(fd, deadline) && hello.fields["dev"] == WorkerProtocol) {
+            try {
+                jobs += stoul(hello.fields["jobs"]);
+            } catch (const exception&) {
+            }
+            WireMessage probe;
+            probe.fields["probe"] = "";
+            probe.Send(fd, deadline);
+        }
+        close(fd);
+    }
+    return jobs;
+}
+#endif
+
+// ninja only runs about one machine's worth of jobs by default so workers would never add anything
+inline vector<string> NinjaCmd(Logger log) {
+    vector<string> cmd = {"ninja"};
+#ifndef _WIN32
+    vector<string> workers = WorkerList();
+    if (!workers.empty() && !UsesModules()) {
+        unsigned int jobs = max(1u, thread::hardware_concurrency()) + WorkerCapacity(workers, log);
+        cmd.insert(cmd.end(), {"-j", to_string(jobs)});
+    }
+#endif
+    return cmd;
+}
+
 inline void GenerateFunc(int argc, char** argv, Logger log) {
     ConfigSetup(log);
     // log.SendMessage(LOGINFO, "starting generation of ninja build script");
@@ -398,7 +1045,16 @@ inline void GenerateFunc(int argc, char** argv, Logger log) {
 
     file << "target=" << TargetDir << "\n";
     file << "objdir=" << ObjDir << "\n";
-    vector<string> cxxflags = CxxFlags;
+    bool modules = UsesModules();
+    vector<string> cxxflags;
+    if (modules) {
+        // user flags go after so their -std still wins if they set one
+        cxxflags = ModuleFlags;
+        cxxflags.push_back("-fprebuilt-module-path=" + PcmDir);
+        fs::create_directories(PcmDir);
+    }
+    vector<string> usercxxflags = CxxFlags;
+    cxxflags.insert(cxxflags.end(), usercxxflags.begin(), usercxxflags.end());
     string cxxflagsstr;
     for (const auto& part : cxxflags) {
         cxxflagsstr += part + " ";
@@ -410,10 +1066,49 @@ inline void GenerateFunc(int argc, char** argv, Logger log) {
     }
     file << "cxxflags=" << cxxflagsstr << "\n";
     file << "ldflags=" << ldflagsstr << "\n\n";
+    // plain TUs get preprocessed here and compiled on a worker, links and modules stay local
+    vector<string> workers = modules ? vector<string>() : WorkerList();
+    for (size_t i = 0; i < usercxxflags.size() && !workers.empty(); i++) {
+        bool takesNext = false;
+        if (IsPreprocessorFlag(usercxxflags[i], takesNext)) {
+            i += takesNext ? 1 : 0;
+        } else if (!IsSafeWorkerFlag(usercxxflags[i])) {
+            log.SendMessage(LOGWARNING, "workers won't take '" + usercxxflags[i] + "' so everything builds locally");
+            workers.clear();
+        }
+    }
+    string plainRule = workers.empty() ? "cxx" : "rcxx";
+    // ninja gets a -j sized for the workers too so keep local work to what this box can handle
+    string localPool;
+    if (!workers.empty()) {
+        file << "pool local\n";
+        file << "   depth = " << max(1u, thread::hardware_concurrency()) << "\n\n";
+        localPool = "   pool = local\n";
+    }
+
     file << "rule cxx\n";
     file << "   command = " << Compiler << " $cxxflags -c $in -o $out\n";
+    file << localPool;
+    if (modules) {
+        // scanning happens inside ninja so editing an import is enough to reorder the build
+        file << "rule scan\n";
+        file << "   command = " << argv[0] << " scan $in $out -- " << Compiler << " $cxxflags -c $in -o $obj\n";
+        file << "   depfile = $out.d\n";
+        file << "   deps = gcc\n";
+        file << "   restat = 1\n";
+        file << "rule collate\n";
+        file << "   command = " << argv[0] << " collate $out $in\n";
+        file << "   restat = 1\n";
+        file << "rule cxxmod\n";
+        file << "   command = " << Compiler << " $cxxflags @$out.modmap -c $in -o $out\n";
+    }
+    if (!workers.empty()) {
+        file << "rule rcxx\n";
+        file << "   command = " << argv[0] << " remote -- " << Compiler << " $cxxflags -c $in -o $out\n";
+    }
     file << "rule link\n";
-    file << "   command = " << Compiler << " $ldflags $in -o $out\n\n";
+    file << "   command = " << Compiler << " $ldflags $in -o $out\n";
+    file << localPool << "\n";
 
     vector<string> donottouch;
     vector<string> sources;
@@ -480,7 +1175,7 @@ inline void GenerateFunc(int argc, char** argv, Logger log) {
             }
         } else {
             auto it = find(donottouch.begin(), donottouch.end(), entry.path().parent_path().stem().string());
-            if (entry.path().extension() == ProjType && it == donottouch.end()) {
+            if ((entry.path().extension() == ProjType || entry.path().extension() == ModuleType) && it == donottouch.end()) {
                 sources.push_back(entry.path().string());
             }
         }
@@ -488,9 +1183,33 @@ inline void GenerateFunc(int argc, char** argv, Logger log) {
 
     vector<string> objfiles;
     for (const auto& src : sources) {
-        string stem = fs::path(src).stem().string() + ".o";
+        // interfaces usually sit next to a .cpp of the same name so keep the extension
+        string stem = fs::path(src).extension() == ModuleType ? fs::path(src).filename().string() + ".o" : fs::path(src).stem().string() + ".o";
         objfiles.push_back(stem);
-        file << "build $objdir/" << stem << ": cxx " << src << "\n";
+        if (!modules) {
+            file << "build $objdir/" << stem << ": " << plainRule << " " << src << "\n";
+            continue;
+        }
+
+        file << "build $objdir/" << stem << ".ddi: scan " << src << "\n";
+        file << "   obj = $objdir/" << stem << "\n";
+        file << "build $objdir/" << stem << ": cxxmod " << src << " | $objdir/" << stem << ".modmap || " << DyndepFile << "\n";
+        file << "   dyndep = " << DyndepFile << "\n";
+    }
+
+    if (modules) {
+        file << "build " << DyndepFile;
+        if (!objfiles.empty()) {
+            file << " |";
+            for (const auto& obj : objfiles) {
+                file << " $objdir/" << obj << ".modmap";
+            }
+        }
+        file << ": collate";
+        for (const auto& obj : objfiles) {
+            file << " $objdir/" << obj << ".ddi";
+        }
+        file << "\n";
     }
 
     file << "\nbuild $target/" << ExeFileName << ": link";
@@ -507,10 +1226,16 @@ inline void GenerateFunc(int argc, char** argv, Logger log) {
     log.SendMessage(LOGINFO, "ninja build script generation finished outputted to -> " + ninjaFile);
 
     log.SendMessage(LOGINFO, "generating compile_commands.json");
-    Task ninjaCompileCmds = {{"ninja", "-t", "compdb", "cxx", "cc"}};
+    Task ninjaCompileCmds = {{"ninja", "-t", "compdb", "cxx", "cxxmod", "rcxx", "cc"}};
     ninjaCompileCmds.run(log, true);
+    // tools would take the launcher for the compiler so hand them the plain command
+    string compdb = ninjaCompileCmds.output;
+    string launcher = string(argv[0]) + " remote -- ";
+    for (size_t at = 0; (at = compdb.find(launcher, at)) != string::npos; ) {
+        compdb.erase(at, launcher.size());
+    }
     ofstream coc("compile_commands.json");
-    coc << ninjaCompileCmds.output;
+    coc << compdb;
     coc.close();
     log.SendMessage(LOGINFO, "compile_commands.json generated");
     // log.SendMessage(LOGINFO, "output of task --> '" + ninjaCompileCmds.output + "'");
@@ -518,7 +1243,7 @@ inline void GenerateFunc(int argc, char** argv, Logger log) {
 
 inline void WatchFunc(int argc, char** argv, Logger log) {
     GenerateFunc(argc, argv, log);
-    Task ninja = {{"ninja"}};
+    Task ninja = {NinjaCmd(log)};
     ninja.run(log);
 
     vector<string> validExt = WatchDefaultExts;
@@ -563,7 +1288,7 @@ inline void WatchFunc(int argc, char** argv, Logger log) {
                 }
                 missingCount[newFile] = 0;
                 GenerateFunc(argc, argv, log);
-                Task ninja = {{"ninja"}};
+                Task ninja = {NinjaCmd(log)};
                 ninja.run(log);
             }
         }
@@ -576,7 +1301,7 @@ inline void WatchFunc(int argc, char** argv, Logger log) {
                     missingCount.erase(it->first);
                     it = fileMod.erase(it);
                     GenerateFunc(argc, argv, log);
-                    Task ninja = {{"ninja"}};
+                    Task ninja = {NinjaCmd(log)};
                     ninja.run(log);
                 } else {
                     ++it;
@@ -594,7 +1319,7 @@ inline void WatchFunc(int argc, char** argv, Logger log) {
                     log.SendMessage(LOGINFO, "file modified: '" + entry.first + "' regenerating ninja script");
                     fileMod[entry.first] = currentModTime;
                     GenerateFunc(argc, argv, log);
-                    Task ninja = {{"ninja"}};
+                    Task ninja = {NinjaCmd(log)};
                     ninja.run(log);
                 }
             } catch (const fs::filesystem_error& e) {
@@ -630,6 +1355,365 @@ inline void CleanFunc(int argc, char** argv, Logger log) {
     }
 }
 
+// ninja runs this per TU: ./dev scan <src> <ddi> -- clang++ <flags> -c <src> -o <obj>
+inline void ScanFunc(int argc, char** argv, Logger log) {
+    if (argc < 6 || string(argv[4]) != "--") {
+        log.SendMessage(LOGERROR, "usage: ./dev scan <src> <ddi> -- <compile command>");
+        exit(69);
+    }
+    string src = argv[2];
+    string ddi = argv[3];
+    vector<string> cmd(argv + 5, argv + argc);
+
+    // keyed on the command as well so changing flags rescans everything
+    string key;
+    for (const auto& part : cmd) {
+        key += part + " ";
+    }
+    string cached = ScanCacheDir + "/" + ContentHash(key + "\n" + ReadWholeFile(src));
+    fs::create_directories(ScanCacheDir);
+
+    // .deps holds a hash over every file the last scan read followed by those files,
+    // so an import hiding in a header still gets picked up when that header changes
+    string json;
+    vector<string> deps;
+    if (fs::exists(cached + ".ddi") && fs::exists(cached + ".deps")) {
+        istringstream in(ReadWholeFile(cached + ".deps"));
+        string hash;
+        string dep;
+        getline(in, hash);
+        while (getline(in, dep)) {
+            deps.push_back(dep);
+        }
+        if (hash == DepsHash(deps)) {
+            json = ReadWholeFile(cached + ".ddi");
+            // bump it so collate treats it as recently used
+            fs::last_write_time(cached + ".ddi", fs::file_time_type::clock::now());
+        }
+    }
+
+    if (json.empty()) {
+        string scanDepfile = ddi + ".scan.d";
+        vector<string> scanCmd = {ScanDeps, "-format=p1689", "--"};
+        scanCmd.insert(scanCmd.end(), cmd.begin(), cmd.end());
+        scanCmd.insert(scanCmd.end(), {"-MD", "-MF", scanDepfile});
+        Task scan = {scanCmd};
+        if (scan.run(log, true, true) != 0) {
+            log.SendMessage(LOGERROR, "failed to scan module dependencies of '" + src + "' --> " + scan.output);
+            exit(1);
+        }
+
+        // diagnostics share the pipe so skip anything before the json starts
+        size_t begin = scan.output.rfind('{', 0) == 0 ? 0 : scan.output.find("\n{");
+        size_t end = scan.output.rfind('}');
+        if (begin == string::npos || end == string::npos || end < begin) {
+            log.SendMessage(LOGERROR, "clang-scan-deps gave back garbage for '" + src + "'");
+            exit(1);
+        }
+        json = scan.output.substr(begin, end - begin + 1);
+
+        deps = ParseDepfile(ReadWholeFile(scanDepfile));
+        fs::remove(scanDepfile);
+        string depsOut = DepsHash(deps) + "\n";
+        for (const auto& dep : deps) {
+            depsOut += dep + "\n";
+        }
+        WriteIfChanged(cached + ".ddi", json);
+        WriteIfChanged(cached + ".deps", depsOut);
+    }
+
+    // ninja reads this back so the scan reruns whenever src or one of its headers changes
+    string depfile = ddi + ":";
+    for (string dep : deps) {
+        for (size_t at = 0; (at = dep.find(' ', at)) != string::npos; at += 2) {
+            dep.insert(at, "\\");
+        }
+        depfile += " " + dep;
+    }
+    ofstream d(ddi + ".d");
+    d << depfile << "\n";
+    d.close();
+
+    if (!WriteIfChanged(ddi, json) || !WriteIfChanged(ddi + ".key", fs::path(cached).filename().string())) {
+        log.SendMessage(LOGERROR, "failed to write scan results to '" + ddi + "'");
+        exit(1);
+    }
+    exit(0);
+}
+
+// ninja runs this once every scan is done: ./dev collate <modules.dd> <ddi...>
+inline void CollateFunc(int argc, char** argv, Logger log) {
+    if (argc < 3) {
+        log.SendMessage(LOGERROR, "usage: ./dev collate <dyndep> <ddi...>");
+        exit(69);
+    }
+    string dyndep = argv[2];
+
+    vector<ModuleInfo> scanned;
+    vector<string> keys;
+    map<string, string> providers;
+    for (int i = 3; i < argc; i++) {
+        string ddi = argv[i];
+        string json = ReadWholeFile(ddi);
+        ModuleInfo info = {ddi.substr(0, ddi.size() - string(".ddi").size()), P1689Names(json, "provides"), {}};
+        for (const auto& name : P1689Names(json, "requires")) {
+            if (!name.empty() && (name[0] == '<' || name[0] == '\\')) {
+                log.SendMessage(LOGWARNING, "header unit '" + name + "' in '" + info.obj + "' isn't supported ignoring...");
+                continue;
+            }
+            info.imports.push_back(name);
+        }
+        for (const auto& name : info.provides) {
+            if (providers.find(name) != providers.end()) {
+                log.SendMessage(LOGERROR, "module '" + name + "' is provided by both '" + providers[name] + "' and '" + info.obj + "'");
+                exit(1);
+            }
+            providers[name] = info.obj;
+        }
+        keys.push_back(ReadWholeFile(ddi + ".key"));
+        scanned.push_back(info);
+    }
+
+    string dd = "ninja_dyndep_version = 1\n";
+    for (const auto& info : scanned) {
+        dd += "build " + info.obj;
+        if (!info.provides.empty()) {
+            dd += " |";
+            for (const auto& name : info.provides) {
+                dd += " " + PcmPath(name);
+            }
+        }
+        dd += ": dyndep";
+
+        vector<string> deps;
+        for (const auto& name : info.imports) {
+            if (providers.find(name) == providers.end()) {
+                log.SendMessage(LOGWARNING, "module '" + name + "' imported by '" + info.obj + "' isn't provided by anything in '" + string(SrcDir) + "'");
+                continue;
+            }
+            deps.push_back(PcmPath(name));
+        }
+        if (!deps.empty()) {
+            dd += " |";
+            for (const auto& dep : deps) {
+                dd += " " + dep;
+            }
+        }
+        dd += "\n";
+
+        // only units the scan says provide something get built as interfaces
+        string modmap;
+        if (!info.provides.empty()) {
+            modmap = "-x c++-module\n-fmodule-output=" + PcmPath(info.provides[0]) + "\n";
+        }
+        if (!WriteIfChanged(info.obj + ".modmap", modmap)) {
+            log.SendMessage(LOGERROR, "failed to write module map for '" + info.obj + "'");
+            exit(1);
+        }
+    }
+
+    if (!WriteIfChanged(dyndep, dd)) {
+        log.SendMessage(LOGERROR, "failed to create the dyndep file: " + dyndep);
+        exit(1);
+    }
+
+    // old BMIs would still satisfy -fprebuilt-module-path after a module is renamed or deleted
+    if (fs::exists(PcmDir)) {
+        for (const auto& entry : fs::directory_iterator(PcmDir)) {
+            bool provided = false;
+            for (const auto& [name, _] : providers) {
+                if (fs::path(PcmPath(name)).filename() == entry.path().filename()) {
+                    provided = true;
+                    break;
+                }
+            }
+            if (!provided && entry.path().extension() == ".pcm") {
+                fs::remove(entry.path());
+            }
+        }
+    }
+
+    // keep the current scans plus the ScanCacheKeep most recently used older ones so
+    // reverting a change doesnt rescan but the cache still cant grow forever
+    if (fs::exists(ScanCacheDir)) {
+        vector<pair<fs::file_time_type, string>> older;
+        for (const auto& entry : fs::directory_iterator(ScanCacheDir)) {
+            if (entry.path().extension() == ".ddi" && find(keys.begin(), keys.end(), entry.path().stem().string()) == keys.end()) {
+                older.push_back({fs::last_write_time(entry.path()), entry.path().stem().string()});
+            }
+        }
+        sort(older.rbegin(), older.rend());
+        for (size_t i = ScanCacheKeep; i < older.size(); i++) {
+            fs::remove(ScanCacheDir + "/" + older[i].second + ".ddi");
+            fs::remove(ScanCacheDir + "/" + older[i].second + ".deps");
+        }
+    }
+    exit(0);
+}
+
+inline void WorkerFunc(int argc, char** argv, Logger log) {
+#ifdef _WIN32
+    log.SendMessage(LOGERROR, "worker mode isn't supported on windows");
+    exit(69);
+#else
+    string addr = argc > 2 ? argv[2] : WorkerDefaultAddr;
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = WorkerSocket(addr, true, log);
+    if (fd < 0) {
+        log.SendMessage(LOGERROR, "failed to listen on '" + addr + "'");
+        exit(69);
+    }
+
+    string host = addr.substr(0, addr.rfind(':'));
+    if (addr.rfind("unix:", 0) != 0 && host != "127.0.0.1" && host != "localhost" && host != "[::1]" && host != "::1") {
+        log.SendMessage(LOGWARNING, "'" + addr + "' isn't loopback, anyone who can reach it can make this box compile things so keep it on a trusted network");
+    }
+
+    unsigned int maxJobs = max(1u, thread::hardware_concurrency());
+    unsigned int active = 0;
+    log.SendMessage(LOGINFO, "worker listening on '" + addr + "' running up to " + to_string(maxJobs) + " jobs");
+
+    for (;;) {
+        int client = accept(fd, nullptr, nullptr);
+        while (active > 0 && waitpid(-1, nullptr, WNOHANG) > 0) {
+            active--;
+        }
+        if (client < 0) {
+            continue;
+        }
+
+        // saying busy straight away lets the driver go elsewhere before sending the source
+        WireMessage hello;
+        hello.fields["dev"] = WorkerProtocol;
+        hello.fields["jobs"] = to_string(maxJobs);
+        if (active >= maxJobs) {
+            hello.fields["status"] = "busy";
+            hello.Send(client, JobDeadline());
+            close(client);
+            continue;
+        }
+        hello.fields["status"] = "ready";
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fd);
+            if (hello.Send(client, JobDeadline())) {
+                ServeJob(client, log);
+            }
+            close(client);
+            _exit(0);
+        } else if (pid > 0) {
+            active++;
+        } else {
+            log.SendMessage(LOGERROR, "failed to fork process for job");
+        }
+        close(client);
+    }
+#endif
+}
+
+// used by ninja as a launcher: ./dev remote -- clang++ <flags> -c <in> -o <out>
+inline void RemoteFunc(int argc, char** argv, Logger log) {
+    vector<string> cmd;
+    for (int i = 2; i < argc; i++) {
+        if (i == 2 && string(argv[i]) == "--") {
+            continue;
+        }
+        cmd.push_back(argv[i]);
+    }
+    if (cmd.empty()) {
+        log.SendMessage(LOGERROR, "no compile command given to remote");
+        exit(69);
+    }
+
+    Task local = {cmd};
+#ifdef _WIN32
+    exit(local.run(log));
+#else
+    string in;
+    string out;
+    vector<string> preflags;
+    vector<string> flags;
+    for (size_t i = 1; i < cmd.size(); i++) {
+        bool takesNext = false;
+        if (cmd[i] == "-o" && i + 1 < cmd.size()) {
+            out = cmd[++i];
+        } else if (cmd[i] == "-c") {
+            continue;
+        } else if (fs::path(cmd[i]).extension() == ProjType) {
+            in = cmd[i];
+        } else if (IsPreprocessorFlag(cmd[i], takesNext)) {
+            preflags.push_back(cmd[i]);
+            if (takesNext && i + 1 < cmd.size()) {
+                preflags.push_back(cmd[++i]);
+            }
+        } else {
+            preflags.push_back(cmd[i]);
+            flags.push_back(cmd[i]);
+        }
+    }
+
+    vector<string> workers = WorkerList();
+    if (workers.empty() || in.empty() || out.empty()) {
+        exit(local.run(log, false, true));
+    }
+    for (const auto& flag : flags) {
+        if (!IsSafeWorkerFlag(flag)) {
+            log.SendMessage(LOGWARNING, "workers won't take '" + flag + "' compiling '" + in + "' locally");
+            exit(local.run(log, false, true));
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    string ii = out + ".ii";
+    vector<string> pre = {cmd[0]};
+    pre.insert(pre.end(), preflags.begin(), preflags.end());
+    pre.insert(pre.end(), {"-E", in, "-o", ii});
+    Task preprocess = {pre};
+    if (preprocess.run(log, true, true) != 0) {
+        // let the real compile print the errors
+        fs::remove(ii);
+        exit(local.run(log));
+    }
+    string source = ReadWholeFile(ii);
+    fs::remove(ii);
+
+    // one deadline for every attempt so a slow worker can't hold things up past WorkerTimeout
+    Deadline deadline = JobDeadline();
+    size_t first = hash<string>{}(out) % workers.size();
+    for (size_t n = 0; n < workers.size(); n++) {
+        const string& addr = workers[(first + n) % workers.size()];
+        WireMessage reply;
+        if (!RemoteCompile(addr, flags, source, reply, log, deadline)) {
+            continue;
+        }
+        if (reply.fields["status"] != "0") {
+            log.SendMessage(LOGWARNING, "worker '" + addr + "' failed to compile '" + in + "'");
+            break;
+        } else if (reply.fields["object"].empty()) {
+            log.SendMessage(LOGWARNING, "worker '" + addr + "' sent back an empty object for '" + in + "'");
+            break;
+        }
+
+        ofstream obj(out, ios::binary);
+        obj << reply.fields["object"];
+        obj.close();
+        if (!obj) {
+            log.SendMessage(LOGWARNING, "failed to write object '" + out + "' from worker '" + addr + "'");
+            break;
+        }
+        if (!reply.fields["output"].empty()) {
+            cerr << reply.fields["output"];
+        }
+        exit(0);
+    }
+
+    log.SendMessage(LOGWARNING, "compiling '" + in + "' locally");
+    exit(local.run(log));
+#endif
+}
+
 inline void GoRebuildYourself(int argc, char** argv, Logger log) {
     if (argc < 1 && !argv[0]) {
         log.SendMessage(LOGERROR, "invalid binary path");